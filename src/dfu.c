@@ -0,0 +1,869 @@
+/*
+ ============================================================================
+ Name        : dfu.c
+ Author      : pikim
+ Version     :
+ Copyright   : GPL v3
+ Description : DfuSe firmware upload for the HIDIRT bootloader
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "dfu.h"
+
+
+#define DFU_TIMEOUT_MS   5000
+#define DFU_MAX_SEGMENTS 8
+#define DFU_MAX_TRANSFER 4096
+#define MAX_LAYOUT_LENGTH 255
+
+#define DFU_INTERFACE_CLASS    0xfe
+#define DFU_INTERFACE_SUBCLASS 0x01
+#define DFU_FUNCTIONAL_DESCRIPTOR 0x21
+
+#define DFU_SIM_FLASH_BASE    0x08000000
+#define DFU_SIM_FLASH_SIZE    (128*1024)
+#define DFU_SIM_PAGE_SIZE     2048
+#define DFU_SIM_TRANSFER_SIZE 2048
+
+#define REQUEST_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+#define REQUEST_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+
+
+enum DfuRequest {
+	DfuDetach    = 0,
+	DfuDnload    = 1,
+	DfuUpload    = 2,
+	DfuGetStatus = 3,
+	DfuClrStatus = 4,
+	DfuGetState  = 5,
+	DfuAbort     = 6
+};
+
+enum DfuState {
+	StateIdle              = 2,
+	StateDnloadSync        = 3,
+	StateDnBusy            = 4,
+	StateDnloadIdle        = 5,
+	StateManifestSync      = 6,
+	StateManifest          = 7,
+	StateManifestWaitReset = 8,
+	StateUploadIdle        = 9,
+	StateError             = 10
+};
+
+enum DfuStatus {
+	StatusOk          = 0x00,
+	StatusErrTarget   = 0x01,
+	StatusErrProg     = 0x06,
+	StatusErrAddress  = 0x08,
+	StatusErrStalled  = 0x0f
+};
+
+// DfuSe commands, sent as download block 0
+enum DfuseCommand {
+	DfuseSetAddress = 0x21,
+	DfuseErase      = 0x41
+};
+
+// a run of equally sized flash pages
+struct segment {
+	uint32_t start;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct dfu_target {
+	// returns the number of bytes transferred or a negative error
+	int (*control)(struct dfu_target *target, bool in, unsigned char request,
+			unsigned short value, unsigned char *data, unsigned short length);
+	void (*release)(struct dfu_target *target);
+
+	unsigned short transfer_size;
+	struct segment segments[DFU_MAX_SEGMENTS];
+	unsigned int segment_count;
+
+	// USB device
+	libusb_context *usb;
+	libusb_device_handle *device;
+	int interface;
+
+	// simulated device
+	char *sim_file;
+	unsigned char *sim_flash;
+	uint32_t sim_size;
+	uint32_t sim_pointer;
+	unsigned char sim_state;
+	unsigned char sim_status;
+	unsigned short sim_block;
+	unsigned short sim_length;
+	unsigned char sim_data[DFU_MAX_TRANSFER];
+};
+
+
+static uint32_t crc32(const unsigned char *data, size_t length) {
+	static uint32_t table[256];
+	uint32_t crc = 0xffffffff;
+	size_t i;
+
+	if (table[1] == 0) {
+		uint32_t n, k, c;
+
+		for (n = 0; n < 256; n++) {
+			c = n;
+			for (k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			}
+			table[n] = c;
+		}
+	}
+
+	for (i = 0; i < length; i++) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffff;
+}
+
+
+static bool is_erased(const unsigned char *data, size_t length) {
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (data[i] != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// parse the DfuSe memory layout, e.g. "@Internal Flash  /0x08000000/64*002Kg"
+static int parse_layout(struct dfu_target *target, const char *layout) {
+	const char *pos;
+	char *end;
+	uint32_t start;
+
+	pos = strchr(layout, '/');
+	if (pos == NULL) {
+		return -1;
+	}
+	start = strtoul(pos+1, &end, 16);
+	if (*end != '/') {
+		return -1;
+	}
+	pos = end + 1;
+
+	target->segment_count = 0;
+	while (target->segment_count < DFU_MAX_SEGMENTS) {
+		struct segment *segment = &target->segments[target->segment_count];
+
+		segment->count = strtoul(pos, &end, 10);
+		if (end == pos || *end != '*') {
+			break;
+		}
+		segment->size = strtoul(end+1, &end, 10);
+		if (*end == 'K') {
+			segment->size *= 1024;
+			end += 1;
+		}
+		else if (*end == 'M') {
+			segment->size *= 1024*1024;
+			end += 1;
+		}
+		if (segment->count == 0 || segment->size == 0) {
+			break;
+		}
+		segment->start = start;
+		start += segment->count * segment->size;
+		target->segment_count += 1;
+
+		// skip the memory type letter(s)
+		while (*end != ',' && *end != '/' && *end != '\0') {
+			end += 1;
+		}
+		if (*end != ',') {
+			break;
+		}
+		pos = end + 1;
+	}
+
+	return target->segment_count ? 0 : -1;
+}
+
+
+static int find_page(const struct dfu_target *target, uint32_t address,
+		uint32_t *page_start, uint32_t *page_size) {
+	unsigned int i;
+
+	for (i = 0; i < target->segment_count; i++) {
+		const struct segment *segment = &target->segments[i];
+
+		if (address >= segment->start
+			&& address - segment->start < segment->count * segment->size) {
+			*page_size = segment->size;
+			*page_start = address - (address - segment->start) % segment->size;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+static uint32_t flash_size(const struct dfu_target *target) {
+	const struct segment *last = &target->segments[target->segment_count-1];
+	return last->start + last->count * last->size - target->segments[0].start;
+}
+
+
+static int dfu_get_status(struct dfu_target *target, unsigned char *state) {
+	unsigned char buf[6];
+	unsigned int poll_timeout;
+	int res;
+
+	res = target->control(target, true, DfuGetStatus, 0, buf, sizeof(buf));
+	if (res < (int)sizeof(buf)) {
+		fprintf(stderr, "DFU_GETSTATUS failed. Errorcode: %d\n", res);
+		return -1;
+	}
+
+	// the device expects no request before the poll timeout expired
+	poll_timeout = buf[1] | (buf[2] << 8) | (buf[3] << 16);
+	if (poll_timeout > 0) {
+		usleep(poll_timeout * 1000);
+	}
+
+	*state = buf[4];
+	return buf[0];
+}
+
+
+static int dfu_abort(struct dfu_target *target) {
+	int res;
+
+	res = target->control(target, false, DfuAbort, 0, NULL, 0);
+	if (res < 0) {
+		fprintf(stderr, "DFU_ABORT failed. Errorcode: %d\n", res);
+		return -1;
+	}
+	return 0;
+}
+
+
+// poll the status until a download was processed
+static int dfu_wait_download(struct dfu_target *target) {
+	unsigned char state;
+	int status;
+
+	do {
+		status = dfu_get_status(target, &state);
+		if (status < 0) {
+			return -1;
+		}
+	} while (status == StatusOk && (state == StateDnloadSync || state == StateDnBusy));
+
+	if (status != StatusOk || state != StateDnloadIdle) {
+		fprintf(stderr, "DFU download failed. Status: %d, state: %d\n", status, state);
+		target->control(target, false, DfuClrStatus, 0, NULL, 0);
+		return -1;
+	}
+	return 0;
+}
+
+
+static int dfu_command(struct dfu_target *target, unsigned char command, uint32_t address) {
+	unsigned char buf[5];
+	int res;
+
+	buf[0] = command;
+	buf[1] = address;
+	buf[2] = address >> 8;
+	buf[3] = address >> 16;
+	buf[4] = address >> 24;
+
+	res = target->control(target, false, DfuDnload, 0, buf, sizeof(buf));
+	if (res < 0) {
+		fprintf(stderr, "DfuSe command 0x%02x failed. Errorcode: %d\n", command, res);
+		return -1;
+	}
+	return dfu_wait_download(target);
+}
+
+
+static int dfu_read(struct dfu_target *target, uint32_t address, unsigned char *data, uint32_t length) {
+	uint32_t offset;
+	unsigned short block;
+	int res;
+
+	// uploads start at the address pointer and require the idle state
+	if (dfu_command(target, DfuseSetAddress, address) != 0 || dfu_abort(target) != 0) {
+		return -1;
+	}
+
+	for (offset = 0, block = 2; offset < length; offset += target->transfer_size, block++) {
+		uint32_t chunk = length - offset;
+
+		if (chunk > target->transfer_size) {
+			chunk = target->transfer_size;
+		}
+		res = target->control(target, true, DfuUpload, block, &data[offset], chunk);
+		if (res != (int)chunk) {
+			fprintf(stderr, "DFU_UPLOAD at 0x%08x failed. Errorcode: %d\n", address + offset, res);
+			return -1;
+		}
+	}
+
+	return dfu_abort(target);
+}
+
+
+static int dfu_write(struct dfu_target *target, uint32_t address, const unsigned char *data, uint32_t length) {
+	uint32_t offset;
+	unsigned short block;
+	int res;
+
+	if (dfu_command(target, DfuseSetAddress, address) != 0) {
+		return -1;
+	}
+
+	for (offset = 0, block = 2; offset < length; offset += target->transfer_size, block++) {
+		uint32_t chunk = length - offset;
+
+		if (chunk > target->transfer_size) {
+			chunk = target->transfer_size;
+		}
+		res = target->control(target, false, DfuDnload, block, (unsigned char *)&data[offset], chunk);
+		if (res != (int)chunk || dfu_wait_download(target) != 0) {
+			fprintf(stderr, "DFU_DNLOAD at 0x%08x failed. Errorcode: %d\n", address + offset, res);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int dfu_flash(struct dfu_target *target, const unsigned char *image, size_t size) {
+	uint32_t base = target->segments[0].start;
+	uint32_t address, page_start, page_size;
+	unsigned int written = 0, skipped = 0, erased = 0;
+	unsigned char *current;
+	uint32_t image_crc, flash_crc;
+	int res = -1;
+
+	if (size == 0 || size > flash_size(target)) {
+		fprintf(stderr, "Image size %zu doesn't fit into %u bytes of flash.\n", size, flash_size(target));
+		return -1;
+	}
+
+	// large enough for the page reads and the final read back
+	current = malloc(size);
+	if (current == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+
+	for (address = base; address < base + size; address = page_start + page_size) {
+		uint32_t length, block, offset;
+		const unsigned char *wanted;
+		unsigned char *present;
+		bool erase = false;
+
+		if (find_page(target, address, &page_start, &page_size) != 0) {
+			fprintf(stderr, "Address 0x%08x is outside of the flash.\n", address);
+			goto out;
+		}
+		length = base + size - page_start;
+		if (length > page_size) {
+			length = page_size;
+		}
+		wanted = &image[page_start - base];
+		present = &current[page_start - base];
+		block = page_size < target->transfer_size ? page_size : target->transfer_size;
+
+		// read back the page and compare it block by block
+		if (dfu_read(target, page_start, present, length) != 0) {
+			goto out;
+		}
+		if (memcmp(present, wanted, length) == 0) {
+			skipped += (length + block - 1) / block;
+			continue;
+		}
+
+		// differing blocks can be written as they are, if they are erased
+		for (offset = 0; offset < length; offset += block) {
+			uint32_t chunk = length - offset < block ? length - offset : block;
+
+			if (memcmp(&present[offset], &wanted[offset], chunk) != 0
+				&& !is_erased(&present[offset], chunk)) {
+				erase = true;
+				break;
+			}
+		}
+		if (erase) {
+			if (dfu_command(target, DfuseErase, page_start) != 0) {
+				goto out;
+			}
+			memset(present, 0xff, length);
+			erased += 1;
+		}
+
+		// write the runs of blocks that differ
+		offset = 0;
+		while (offset < length) {
+			uint32_t run = offset;
+
+			while (run < length) {
+				uint32_t chunk = length - run < block ? length - run : block;
+
+				if (memcmp(&present[run], &wanted[run], chunk) == 0) {
+					break;
+				}
+				run += chunk;
+			}
+
+			if (run > offset) {
+				if (dfu_write(target, page_start + offset, &wanted[offset], run - offset) != 0) {
+					goto out;
+				}
+				written += (run - offset + block - 1) / block;
+				offset = run;
+			}
+			else {
+				skipped += 1;
+				offset += length - offset < block ? length - offset : block;
+			}
+		}
+	}
+
+	// verify the whole image
+	if (dfu_read(target, base, current, size) != 0) {
+		goto out;
+	}
+	image_crc = crc32(image, size);
+	flash_crc = crc32(current, size);
+	if (image_crc != flash_crc) {
+		fprintf(stderr, "Verification failed. CRC32 of image: 0x%08x, flash: 0x%08x\n", image_crc, flash_crc);
+		goto out;
+	}
+
+	fprintf(stdout, "%u blocks written, %u blocks skipped, %u pages erased.\n", written, skipped, erased);
+	fprintf(stdout, "Verified %zu bytes. CRC32: 0x%08x\n", size, flash_crc);
+	res = 0;
+
+out:
+	free(current);
+	return res;
+}
+
+
+int dfu_leave(struct dfu_target *target) {
+	unsigned char state;
+	int res;
+
+	// a zero length download starts the firmware at the address pointer
+	if (dfu_command(target, DfuseSetAddress, target->segments[0].start) != 0) {
+		return -1;
+	}
+	res = target->control(target, false, DfuDnload, 2, NULL, 0);
+	if (res < 0) {
+		fprintf(stderr, "Leaving DFU mode failed. Errorcode: %d\n", res);
+		return -1;
+	}
+
+	// the device may reset before the status is answered
+	dfu_get_status(target, &state);
+	return 0;
+}
+
+
+void dfu_close(struct dfu_target *target) {
+	if (target != NULL) {
+		target->release(target);
+		free(target);
+	}
+}
+
+
+static int usb_control(struct dfu_target *target, bool in, unsigned char request,
+		unsigned short value, unsigned char *data, unsigned short length) {
+	return libusb_control_transfer(target->device, in ? REQUEST_IN : REQUEST_OUT,
+			request, value, target->interface, data, length, DFU_TIMEOUT_MS);
+}
+
+
+static void usb_release(struct dfu_target *target) {
+	if (target->device != NULL) {
+		libusb_release_interface(target->device, target->interface);
+		libusb_close(target->device);
+	}
+	if (target->usb != NULL) {
+		libusb_exit(target->usb);
+	}
+}
+
+
+// wTransferSize of the DFU functional descriptor in extra descriptors, or 0
+static unsigned int find_transfer_size(const unsigned char *extra, int length) {
+	int i;
+
+	for (i = 0; i + 7 <= length; i += extra[i]) {
+		if (extra[i] < 2) {
+			break;
+		}
+		if (extra[i+1] == DFU_FUNCTIONAL_DESCRIPTOR) {
+			return extra[i+5] | (extra[i+6] << 8);
+		}
+	}
+	return 0;
+}
+
+
+// find the DFU interface, its transfer size and its memory layout
+static int usb_describe(struct dfu_target *target) {
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface *interface = NULL;
+	const struct libusb_interface_descriptor *alt = NULL;
+	unsigned char layout[MAX_LAYOUT_LENGTH];
+	unsigned int transfer_size = 0;
+	int i, res;
+
+	res = libusb_get_active_config_descriptor(libusb_get_device(target->device), &config);
+	if (res != 0) {
+		fprintf(stderr, "Reading the configuration descriptor failed. Errorcode: %d\n", res);
+		return -1;
+	}
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface_descriptor *candidate = &config->interface[i].altsetting[0];
+
+		if (candidate->bInterfaceClass == DFU_INTERFACE_CLASS
+			&& candidate->bInterfaceSubClass == DFU_INTERFACE_SUBCLASS) {
+			interface = &config->interface[i];
+			alt = candidate;
+			break;
+		}
+	}
+	if (alt == NULL) {
+		fprintf(stderr, "No DFU interface found.\n");
+		libusb_free_config_descriptor(config);
+		return -1;
+	}
+	target->interface = alt->bInterfaceNumber;
+
+	// the functional descriptor tells the largest supported block size. it
+	// follows the last alternate setting, so libusb attaches it to that one
+	// or to the configuration, like dfu-util expects
+	for (i = 0; i < interface->num_altsetting && transfer_size == 0; i++) {
+		transfer_size = find_transfer_size(interface->altsetting[i].extra,
+				interface->altsetting[i].extra_length);
+	}
+	if (transfer_size == 0) {
+		transfer_size = find_transfer_size(config->extra, config->extra_length);
+	}
+	if (transfer_size == 0) {
+		fprintf(stderr, "No DFU functional descriptor found.\n");
+		libusb_free_config_descriptor(config);
+		return -1;
+	}
+
+	// smaller blocks than announced are fine for the device
+	target->transfer_size = transfer_size < DFU_MAX_TRANSFER ? transfer_size : DFU_MAX_TRANSFER;
+
+	// alternate setting 0 is the internal flash
+	res = libusb_get_string_descriptor_ascii(target->device, alt->iInterface, layout, sizeof(layout));
+	libusb_free_config_descriptor(config);
+	if (res < 0 || parse_layout(target, (const char *)layout) != 0) {
+		fprintf(stderr, "Reading the DFU memory layout failed. Errorcode: %d\n", res);
+		return -1;
+	}
+	return 0;
+}
+
+
+struct dfu_target *dfu_open_usb(unsigned short vid, unsigned short pid, int timeout_ms) {
+	struct dfu_target *target;
+	unsigned char state;
+	int waited, res;
+
+	target = calloc(1, sizeof(*target));
+	if (target == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return NULL;
+	}
+	target->control = usb_control;
+	target->release = usb_release;
+
+	res = libusb_init(&target->usb);
+	if (res != 0) {
+		fprintf(stderr, "libusb_init() failed. Errorcode: %d\n", res);
+		target->usb = NULL;
+		dfu_close(target);
+		return NULL;
+	}
+
+	// the device needs some time to enumerate after switching modes
+	for (waited = 0; ; waited += 100) {
+		target->device = libusb_open_device_with_vid_pid(target->usb, vid, pid);
+		if (target->device != NULL || waited >= timeout_ms) {
+			break;
+		}
+		usleep(100*1000);
+	}
+	if (target->device == NULL) {
+		fprintf(stderr, "DFU device %04x:%04x not found.\n", vid, pid);
+		dfu_close(target);
+		return NULL;
+	}
+
+	if (usb_describe(target) != 0) {
+		dfu_close(target);
+		return NULL;
+	}
+
+	res = libusb_claim_interface(target->device, target->interface);
+	if (res == 0) {
+		res = libusb_set_interface_alt_setting(target->device, target->interface, 0);
+	}
+	if (res != 0) {
+		fprintf(stderr, "Claiming the DFU interface failed. Errorcode: %d\n", res);
+		dfu_close(target);
+		return NULL;
+	}
+
+	// start from the idle state
+	if (dfu_get_status(target, &state) == StatusOk && state == StateError) {
+		target->control(target, false, DfuClrStatus, 0, NULL, 0);
+	}
+	dfu_abort(target);
+
+	return target;
+}
+
+
+static void sim_execute(struct dfu_target *target) {
+	uint32_t address, page_start, page_size, i;
+
+	if (target->sim_block == 0) {
+		// DfuSe command
+		address = target->sim_data[1] | (target->sim_data[2] << 8)
+				| (target->sim_data[3] << 16) | ((uint32_t)target->sim_data[4] << 24);
+		if (target->sim_length != 5) {
+			target->sim_status = StatusErrStalled;
+			return;
+		}
+
+		switch (target->sim_data[0]) {
+			case DfuseSetAddress:
+				target->sim_pointer = address;
+				break;
+
+			case DfuseErase:
+				if (find_page(target, address, &page_start, &page_size) != 0) {
+					target->sim_status = StatusErrAddress;
+					return;
+				}
+				memset(&target->sim_flash[page_start - DFU_SIM_FLASH_BASE], 0xff, page_size);
+				break;
+
+			default:
+				target->sim_status = StatusErrStalled;
+				break;
+		}
+		return;
+	}
+
+	// data block, relative to the address pointer
+	address = target->sim_pointer + (target->sim_block - 2) * target->transfer_size;
+	if (address < DFU_SIM_FLASH_BASE
+		|| address - DFU_SIM_FLASH_BASE + target->sim_length > target->sim_size) {
+		target->sim_status = StatusErrAddress;
+		return;
+	}
+
+	// like real flash, only erased memory can be programmed
+	for (i = 0; i < target->sim_length; i++) {
+		unsigned char *cell = &target->sim_flash[address - DFU_SIM_FLASH_BASE + i];
+
+		if (*cell != 0xff && *cell != target->sim_data[i]) {
+			target->sim_status = StatusErrProg;
+			return;
+		}
+		*cell = target->sim_data[i];
+	}
+}
+
+
+static int sim_store(struct dfu_target *target) {
+	FILE *file;
+	size_t res;
+
+	file = fopen(target->sim_file, "wb");
+	if (file == NULL) {
+		perror("Writing simulated flash failed");
+		return -1;
+	}
+	res = fwrite(target->sim_flash, 1, target->sim_size, file);
+	fclose(file);
+	return res == target->sim_size ? 0 : -1;
+}
+
+
+static int sim_control(struct dfu_target *target, bool in, unsigned char request,
+		unsigned short value, unsigned char *data, unsigned short length) {
+	uint32_t address;
+
+	switch (request) {
+		case DfuDnload:
+			if (in || (target->sim_state != StateIdle && target->sim_state != StateDnloadIdle)
+				|| length > target->transfer_size) {
+				break;
+			}
+			if (length == 0) {
+				target->sim_state = StateManifestSync;
+				return 0;
+			}
+			memcpy(target->sim_data, data, length);
+			target->sim_block = value;
+			target->sim_length = length;
+			target->sim_state = StateDnloadSync;
+			return length;
+
+		case DfuUpload:
+			if (!in || value < 2
+				|| (target->sim_state != StateIdle && target->sim_state != StateUploadIdle)) {
+				break;
+			}
+			address = target->sim_pointer + (value - 2) * target->transfer_size;
+			if (address < DFU_SIM_FLASH_BASE || address - DFU_SIM_FLASH_BASE >= target->sim_size) {
+				break;
+			}
+			if (length > target->sim_size - (address - DFU_SIM_FLASH_BASE)) {
+				length = target->sim_size - (address - DFU_SIM_FLASH_BASE);
+			}
+			memcpy(data, &target->sim_flash[address - DFU_SIM_FLASH_BASE], length);
+			target->sim_state = StateUploadIdle;
+			return length;
+
+		case DfuGetStatus:
+			if (!in || length < 6) {
+				break;
+			}
+			// downloads are processed while the host polls the status
+			if (target->sim_state == StateDnloadSync) {
+				sim_execute(target);
+				target->sim_state = target->sim_status == StatusOk ? StateDnBusy : StateError;
+			}
+			else if (target->sim_state == StateDnBusy) {
+				target->sim_state = StateDnloadIdle;
+			}
+			else if (target->sim_state == StateManifestSync) {
+				if (sim_store(target) != 0) {
+					target->sim_status = StatusErrTarget;
+				}
+				target->sim_state = target->sim_status == StatusOk ? StateManifestWaitReset : StateError;
+			}
+			memset(data, 0, 6);
+			data[0] = target->sim_status;
+			data[4] = target->sim_state;
+			return 6;
+
+		case DfuClrStatus:
+			target->sim_status = StatusOk;
+			target->sim_state = StateIdle;
+			return 0;
+
+		case DfuGetState:
+			if (!in || length < 1) {
+				break;
+			}
+			data[0] = target->sim_state;
+			return 1;
+
+		case DfuAbort:
+			if (target->sim_state != StateError) {
+				target->sim_state = StateIdle;
+			}
+			return 0;
+	}
+
+	// unexpected requests stall, like on the real device
+	target->sim_status = StatusErrStalled;
+	target->sim_state = StateError;
+	return LIBUSB_ERROR_PIPE;
+}
+
+
+static void sim_release(struct dfu_target *target) {
+	free(target->sim_flash);
+	free(target->sim_file);
+}
+
+
+struct dfu_target *dfu_open_simulated(const char *flash_file) {
+	struct dfu_target *target;
+	char layout[MAX_LAYOUT_LENGTH];
+	FILE *file;
+
+	target = calloc(1, sizeof(*target));
+	if (target == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return NULL;
+	}
+	target->control = sim_control;
+	target->release = sim_release;
+	target->transfer_size = DFU_SIM_TRANSFER_SIZE;
+	target->sim_state = StateIdle;
+	target->sim_status = StatusOk;
+	target->sim_file = strdup(flash_file);
+
+	// an existing file defines the flash size, otherwise start erased
+	target->sim_size = DFU_SIM_FLASH_SIZE;
+	file = fopen(flash_file, "rb");
+	if (file != NULL) {
+		fseek(file, 0, SEEK_END);
+		target->sim_size = ftell(file);
+		rewind(file);
+	}
+	if (target->sim_size == 0 || target->sim_size % DFU_SIM_PAGE_SIZE != 0) {
+		fprintf(stderr, "Size of %s must be a multiple of %d.\n", flash_file, DFU_SIM_PAGE_SIZE);
+		if (file != NULL) {
+			fclose(file);
+		}
+		dfu_close(target);
+		return NULL;
+	}
+
+	target->sim_flash = malloc(target->sim_size);
+	if (target->sim_file == NULL || target->sim_flash == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		if (file != NULL) {
+			fclose(file);
+		}
+		dfu_close(target);
+		return NULL;
+	}
+	memset(target->sim_flash, 0xff, target->sim_size);
+	if (file != NULL) {
+		if (fread(target->sim_flash, 1, target->sim_size, file) != target->sim_size) {
+			fprintf(stderr, "Reading %s failed.\n", flash_file);
+			fclose(file);
+			dfu_close(target);
+			return NULL;
+		}
+		fclose(file);
+	}
+
+	// same layout description as the real bootloader
+	snprintf(layout, sizeof(layout), "@Internal Flash  /0x%08x/%03u*%03uKg",
+			DFU_SIM_FLASH_BASE, target->sim_size / DFU_SIM_PAGE_SIZE, DFU_SIM_PAGE_SIZE / 1024);
+	parse_layout(target, layout);
+
+	return target;
+}
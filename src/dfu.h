@@ -0,0 +1,38 @@
+/*
+ ============================================================================
+ Name        : dfu.h
+ Author      : pikim
+ Version     :
+ Copyright   : GPL v3
+ Description : DfuSe firmware upload for the HIDIRT bootloader
+ ============================================================================
+ */
+
+#ifndef DFU_H_
+#define DFU_H_
+
+#include <stddef.h>
+
+
+#define DFU_VID 0x0483 // STM32 bootloader
+#define DFU_PID 0xdf11
+
+struct dfu_target;
+
+
+// wait up to timeout_ms for the DFU device to enumerate and open it
+struct dfu_target *dfu_open_usb(unsigned short vid, unsigned short pid, int timeout_ms);
+
+// open a simulated DFU device whose flash memory is kept in the given file
+struct dfu_target *dfu_open_simulated(const char *flash_file);
+
+// write a raw binary image to the start of the internal flash. blocks that
+// already match are skipped, the result is verified using CRC32
+int dfu_flash(struct dfu_target *target, const unsigned char *image, size_t size);
+
+// leave DFU mode, the device resets and starts the firmware
+int dfu_leave(struct dfu_target *target);
+
+void dfu_close(struct dfu_target *target);
+
+#endif /* DFU_H_ */
@@ -8,27 +8,66 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE // sched_setaffinity(), SCHED_RESET_ON_FORK
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <sched.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include <libconfig.h>
 #include <xdo.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
 
 #include "hidapi.h"
+#include "dfu.h"
 
 
 #define HIDIRT_VID 0x0483 // for testing only
 #define HIDIRT_PID 0x6611 // for testing only
 
+#define DFU_ENUMERATION_TIMEOUT_MS (5*1000)  // until the bootloader shows up
+#define APP_ENUMERATION_TIMEOUT_MS (10*1000) // until the firmware shows up again
+
 #define MAX_FEATURE_REPORT_LENGTH 16
 #define MAX_STRING_LENGTH 255
 
+#define GLOBAL_CONTEXT 0 // index of the context holding all unscoped mappings
+
+#define MAX_PROTOCOL 0xff
+#define MAX_ADDRESS  0xffff
+#define MAX_COMMAND  0xffff
+
+#define IR_REPORT_LENGTH 7 // report ID, protocol, address, command, flags
+
+#define TX_PRIORITIES   4  // transmit_priority 0 (lowest) to 3 (highest)
+#define TX_QUEUE_LENGTH 16 // pending frames per priority
+
+#define ACTION_QUEUE_LENGTH 64 // pending key and application actions
+
+#define PREFAULT_STACK_SIZE (256*1024)
+#define THREAD_STACK_SIZE   (256*1024) // focus, action and transmitter thread
+#define LOAD_STACK_SIZE     (64*1024)  // busy threads of the jitter measurement
+#define JITTER_PERIOD_NS    (1000*1000) // wakeup period of the jitter measurement
+#define JITTER_BUCKETS      16          // log2 histogram buckets in microseconds
+
+static const char* options = "b::i::n::f::r::m::t::d::w::s::u::e::a::x::j::U::S::v";
 static const char* config_file = "hidirt.cfg";
-static hid_device* handle;
+static hid_device* handle;    // used by the main thread (reader) only
+static hid_device* tx_handle; // used by the transmitter thread only
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER; // guards hid_open() and hid_close()
 static config_t cfg;
 static xdo_t* x;
 
@@ -58,6 +97,132 @@ struct __attribute__((__packed__)) ircode {
 	unsigned char  flags;    // flags, e.g. repetition
 };
 
+// what to do with several pending actions of the same mapping
+enum CoalescePolicy {
+	CoalesceNone,     // run every action
+	CoalesceCollapse, // run identical actions once
+	CoalesceLatest,   // run only the newest action
+	CoalesceCount     // run identical actions once, pass the number of them
+};
+
+// a pattern for one IR field of a mapping. a value matches if
+// (value & mask) == bits and low <= value <= high. this covers exact values,
+// masks ("0x5a00/0xff00"), ranges ("0x00-0x09") and wildcards ("*").
+struct pattern {
+	unsigned int bits;
+	unsigned int mask;
+	unsigned int low;
+	unsigned int high;
+};
+
+enum Field {
+	FieldProtocol,
+	FieldAddress,
+	FieldCommand
+};
+
+// a mapping as compiled from the config file
+struct mapping {
+	struct pattern protocol;
+	struct pattern address;
+	struct pattern command;
+	unsigned int command_base; // lowest matching command, for %i
+	int priority;              // explicit precedence, higher wins
+	uint64_t codes;            // number of matching IR codes, fewer wins
+	unsigned int order;        // index in the config file
+	unsigned int context;
+	const char *key;         // NULL if no key (sequence) is to be sent
+	const char *application; // NULL if no application is to be started
+	const char *parameter;
+	bool placeholders;       // true if key and parameter contain placeholders
+	bool transmit;           // true if transmit_report is to be sent
+	int transmit_priority;
+	unsigned char transmit_report[IR_REPORT_LENGTH];
+	enum CoalescePolicy coalesce;
+};
+
+// a key and/or application action waiting to be run
+struct action {
+	const struct mapping *mapping; // NULL once coalesced into another action
+	struct ircode ir_code;
+};
+
+// the mappings of a context apply while a matching window has the focus
+struct context {
+	const char *window_class; // NULL matches any window class
+	const char *window_name;  // NULL matches any window name
+};
+
+// maps every value of an IR field to the bitset of mappings whose pattern
+// matches it. values with equal bitsets share one entry in classes.
+struct field_index {
+	unsigned short *class_of;
+	uint64_t *classes;
+	unsigned int class_count;
+};
+
+static bool send_keys;
+static bool start_apps;
+static bool transmit_codes;
+
+// mappings are sorted by precedence, bit n of the bitsets is mappings[n]
+static struct mapping *mappings;
+static unsigned int mapping_count;
+static unsigned int set_words; // 64 bit words per bitset
+static struct field_index protocol_index, address_index, command_index;
+static uint64_t *context_sets; // per context, the bitset of its mappings
+
+static struct context *contexts;
+static unsigned int context_count;
+
+// index of the context for the focused window. written by the focus thread
+// whenever X reports a focus or title change, read on every received IR code
+static atomic_uint focused_context = GLOBAL_CONTEXT;
+static pthread_t focus_thread;
+static bool focus_thread_running;
+
+// opt-in low latency runtime profile for the device reader
+struct runtime_profile {
+	bool enable;
+	int policy;   // SCHED_FIFO or SCHED_RR
+	int priority;
+	int cpu;      // -1 means no affinity
+};
+
+static struct runtime_profile profile = { false, SCHED_FIFO, 50, -1 };
+
+// frames waiting for transmission. the frames point to the reports that were
+// built when the mappings were loaded, so queueing never copies or allocates.
+struct tx_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	const unsigned char *frames[TX_PRIORITIES][TX_QUEUE_LENGTH];
+	unsigned int head[TX_PRIORITIES];
+	unsigned int count[TX_PRIORITIES];
+	bool stop;
+};
+
+static struct tx_queue tx = { .ready = PTHREAD_COND_INITIALIZER }; // lock is set up by init_queue_lock()
+static pthread_t tx_thread;
+static bool tx_thread_running;
+
+// actions waiting for the action thread. sending keys and starting
+// applications may be slower than IR codes arrive, so the action thread
+// takes all pending actions at once and coalesces them per mapping.
+struct action_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct action actions[ACTION_QUEUE_LENGTH];
+	unsigned int head;
+	unsigned int count;
+	bool stop;
+};
+
+static struct action_queue aq = { .ready = PTHREAD_COND_INITIALIZER }; // lock is set up by init_queue_lock()
+static struct action action_batch[ACTION_QUEUE_LENGTH];
+static pthread_t action_thread;
+static bool action_thread_running;
+
 
 int feature_bool(hid_device *handle, unsigned char report_id, char *arg) {
 	int res;
@@ -429,6 +594,89 @@ int show_device_details(hid_device *handle) {
 }
 
 
+int update_firmware(char *firmware, char *simulation) {
+	FILE *file;
+	long size;
+	unsigned char *image;
+	struct dfu_target *target;
+	int res;
+
+	// skip the '=' of the arguments
+	if (*firmware == '=') {
+		firmware += 1;
+	}
+	if (simulation && *simulation == '=') {
+		simulation += 1;
+	}
+
+	// read the raw binary image
+	file = fopen(firmware, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Error opening firmware file %s\n", firmware);
+		return -1;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	image = malloc(size > 0 ? size : 1);
+	if (image == NULL || fread(image, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "Error reading firmware file %s\n", firmware);
+		fclose(file);
+		free(image);
+		return -1;
+	}
+	fclose(file);
+
+	if (simulation) {
+		target = dfu_open_simulated(simulation);
+	}
+	else {
+		// switch into DFU mode, unless the device is there already
+		hid_device *device = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
+		if (device != NULL) {
+			unsigned char buf[2] = { RequestBootloader, 0x5a };
+
+			res = hid_send_feature_report(device, buf, sizeof(buf));
+			if (res < 1) {
+				fprintf(stderr, "Error writing ReportID: %d. Errorcode: %d\n", buf[0], res);
+			}
+			hid_close(device);
+		}
+		target = dfu_open_usb(DFU_VID, DFU_PID, DFU_ENUMERATION_TIMEOUT_MS);
+	}
+	if (target == NULL) {
+		free(image);
+		return -1;
+	}
+
+	res = dfu_flash(target, image, size);
+	if (res == 0) {
+		res = dfu_leave(target);
+	}
+	dfu_close(target);
+	free(image);
+
+	// wait until the device is back with the new firmware
+	if (res == 0 && !simulation) {
+		hid_device *device = NULL;
+		int waited;
+
+		for (waited = 0; device == NULL && waited < APP_ENUMERATION_TIMEOUT_MS; waited += 100) {
+			usleep(100*1000);
+			device = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
+		}
+		if (device == NULL) {
+			fprintf(stderr, "Device didn't re-enumerate after the update.\n");
+			return -1;
+		}
+		show_device_details(device);
+		hid_close(device);
+	}
+
+	return res;
+}
+
+
 int create_config_file(void) {
 	config_t cfg;
 	config_setting_t *root, *name, *setting, *settings, *mapping, *mappings;
@@ -451,6 +699,9 @@ int create_config_file(void) {
 	setting = config_setting_add(settings, "start_apps", CONFIG_TYPE_BOOL);
 	config_setting_set_bool(setting, false);
 
+	setting = config_setting_add(settings, "transmit_codes", CONFIG_TYPE_BOOL);
+	config_setting_set_bool(setting, false);
+
 	setting = config_setting_add(settings, "sync_clocks", CONFIG_TYPE_BOOL);
 	config_setting_set_bool(setting, false);
 
@@ -460,6 +711,9 @@ int create_config_file(void) {
 	setting = config_setting_add(settings, "calibration_start_time", CONFIG_TYPE_INT64);
 	config_setting_set_int64(setting, 0);
 
+	setting = config_setting_add(settings, "low_latency", CONFIG_TYPE_BOOL);
+	config_setting_set_bool(setting, false);
+
 	// add a mapping to the list
 	mapping = config_setting_add(mappings, NULL, CONFIG_TYPE_GROUP);
 
@@ -523,233 +777,1533 @@ int create_config_file(void) {
 }
 
 
-void handle_ir_code(struct ircode* ir_code) {
-	config_setting_t *mappings;
+// parse a number up to the next delimiter like for -x: hex if there is an
+// 'x', decimal otherwise. so "0x10" is 16 and "010" is 10, never octal.
+static int parse_number(const char *str, const char *delim, unsigned long max,
+		unsigned long *value, const char **end) {
+	const char *next = str + strcspn(str, delim);
+	const char *x_pos = memchr(str, 'x', next - str);
+	char *stop;
 
-	// read settings
-	int send_keys = false;
-	config_lookup_bool(&cfg, "settings.send_keys", &send_keys);
+	if (x_pos != NULL) {
+		// hex notation
+		*value = strtoul(x_pos+1, &stop, 16);
+		if (stop == x_pos+1) {
+			return -1;
+		}
+	}
+	else {
+		// decimal notation
+		*value = strtoul(str, &stop, 10);
+		if (stop == str) {
+			return -1;
+		}
+	}
+	if (stop != next || *value > max) {
+		return -1;
+	}
+	*end = next;
+	return 0;
+}
 
-	int start_apps = false;
-	config_lookup_bool(&cfg, "settings.start_apps", &start_apps);
 
-	// get all the mappings
-	mappings = config_lookup(&cfg, "mappings");
-	if (mappings != NULL) {
-		unsigned int count = config_setting_length(mappings);
-		unsigned int i;
+static int parse_ircode_report(const char *str, unsigned char *buf) {
+	static const unsigned long max[4] = { 0xff, 0xffff, 0xffff, 0xff };
+	unsigned long value[4] = { 0, 0, 0, 0 };
+	const char *end;
+	int idx;
 
-		for (i = 0; i < count; i++) {
-			// get one single mapping
-			config_setting_t *mapping = config_setting_get_elem(mappings, i);
-			int protocol, address, command;
-			const char *key, *application, *parameter;
-
-			// if any of the settings doesn't exist, proceed to next mapping
-			if ( !(config_setting_lookup_int(mapping, "ir_protocol", &protocol)
-				&& config_setting_lookup_int(mapping, "ir_address", &address)
-				&& config_setting_lookup_int(mapping, "ir_command", &command)) ) {
-				continue;
-			}
+	// "protocol,address,command[,flags]"
+	for (idx = 0; idx < 4 && *str != '\0'; idx++) {
+		if (parse_number(str, " ,;", max[idx], &value[idx], &end) != 0) {
+			return -1;
+		}
+		str = end + strspn(end, " ,;");
+	}
+	if (idx < 3 || *str != '\0') {
+		return -1;
+	}
 
-			// if the IR data doesn't match, proceed to next mapping
-			if (protocol != ir_code->protocol ||
-				address != ir_code->address ||
-				command != ir_code->command) {
-				continue;
-			}
+	buf[0] = IrCodeInterrupt;
+	buf[1] = value[0];
+	buf[2] = value[1];
+	buf[3] = value[1] >> 8;
+	buf[4] = value[2];
+	buf[5] = value[2] >> 8;
+	buf[6] = value[3];
+	return 0;
+}
 
-			// send key (sequence) if there is any and this feature is enabled
-			if (send_keys
-				&& config_setting_lookup_string(mapping, "key", &key)) {
-				xdo_send_keysequence_window(x, CURRENTWINDOW, key, 2000);
-			}
 
-			// start app if there is any and this feature is enabled
-			if (start_apps
-				&& config_setting_lookup_string(mapping, "application", &application)
-				&& config_setting_lookup_string(mapping, "parameter", &parameter)) {
-				char call[256];
-				strcpy(call, application);
-				strcat(call, " ");
-				strcat(call, parameter);
-				system(call);
-			}
-		}
+static bool str_equal(const char *a, const char *b) {
+	if (a == NULL || b == NULL) {
+		return a == b;
 	}
+	return strcmp(a, b) == 0;
 }
 
 
-void cleanup(void) {
-	int res;
+static int parse_pattern(const config_setting_t *mapping, const char *name,
+		unsigned int max, struct pattern *pattern) {
+	const config_setting_t *setting;
+	const char *str, *end;
+	unsigned long value, second;
 
-	// close xdo
-	xdo_free(x);
+	// matches everything
+	pattern->bits = 0;
+	pattern->mask = 0;
+	pattern->low = 0;
+	pattern->high = max;
 
-	// close the config
-	config_destroy(&cfg);
+	setting = config_setting_get_member(mapping, name);
+	if (setting == NULL) {
+		return -1;
+	}
 
-	// close the device
-	hid_close(handle);
+	if (config_setting_type(setting) == CONFIG_TYPE_INT
+		|| config_setting_type(setting) == CONFIG_TYPE_INT64) {
+		long long number = config_setting_get_int64(setting);
+		if (number < 0 || number > max) {
+			return -1;
+		}
+		pattern->bits = number;
+		pattern->mask = max;
+		return 0;
+	}
+	if (config_setting_type(setting) != CONFIG_TYPE_STRING) {
+		return -1;
+	}
 
-	// finalize the hidapi library
-	res = hid_exit();
-	if (res != 0) {
-		fprintf(stderr, "hid_exit() failed. Errorcode: %d\n", res);
+	str = config_setting_get_string(setting);
+	if (strcmp(str, "*") == 0) {
+		return 0;
+	}
+
+	// numbers are decimal or hex like for -x and transmit
+	if (parse_number(str, "-/", max, &value, &end) != 0) {
+		return -1;
+	}
+	if (*end == '-') {
+		// range
+		if (parse_number(end+1, "", max, &second, &end) != 0 || second < value) {
+			return -1;
+		}
+		pattern->low = value;
+		pattern->high = second;
+	}
+	else if (*end == '/') {
+		// value/mask
+		if (parse_number(end+1, "", max, &second, &end) != 0) {
+			return -1;
+		}
+		pattern->mask = second;
+		pattern->bits = value & second;
 	}
+	else {
+		pattern->bits = value;
+		pattern->mask = max;
+	}
+	return 0;
 }
 
 
-int main(int argc, char* argv[]) {
-	int res;
-	char option;
-	bool verbose = false;
+static inline bool pattern_matches(const struct pattern *pattern, unsigned int value) {
+	return (value & pattern->mask) == pattern->bits
+		&& value >= pattern->low
+		&& value <= pattern->high;
+}
 
-	// prepare xdo and config
-	x = xdo_new(NULL);
-	config_init(&cfg);
 
-	// try to read config file or create one if none exists
-	if (access(config_file, R_OK) == 0) {
-		// file exists
-		// read the file. if there is an error, report it and exit
-		if (!config_read_file(&cfg, config_file)) {
-			fprintf(stderr, "Error reading config file %s, line %d - %s\n",
-					config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
-			config_destroy(&cfg);
-			exit(EXIT_FAILURE);
-		}
+// number of values matching a pattern built by parse_pattern()
+static uint64_t pattern_size(const struct pattern *pattern, unsigned int max) {
+	if (pattern->mask == 0) {
+		return pattern->high - pattern->low + 1;
 	}
-	else {
-		// file doesn't exist
-		create_config_file();
+	return 1ULL << __builtin_popcount(max & ~pattern->mask);
+}
+
+
+static const struct pattern *field_pattern(const struct mapping *mapping, enum Field field) {
+	switch (field) {
+		case FieldProtocol:
+			return &mapping->protocol;
+		case FieldAddress:
+			return &mapping->address;
+		default:
+			return &mapping->command;
 	}
+}
 
-	// register cleanup function
-	res = atexit(cleanup);
-	if (res != 0) {
-		fprintf(stderr, "Registering cleanup failed. Errorcode: %d\n", res);
-		exit(EXIT_FAILURE);
+
+// explicit precedence: priority, then specificity, then config file order
+static int compare_precedence(const void *a, const void *b) {
+	const struct mapping *ma = a, *mb = b;
+
+	if (ma->priority != mb->priority) {
+		return ma->priority > mb->priority ? -1 : 1;
+	}
+	if (ma->codes != mb->codes) {
+		return ma->codes < mb->codes ? -1 : 1;
 	}
+	return (ma->order > mb->order) - (ma->order < mb->order);
+}
 
-	// initialize the hidapi library
-	res = hid_init();
-	if (res != 0) {
-		fprintf(stderr, "hid_init() failed. Errorcode: %d\n", res);
-		exit(EXIT_FAILURE);
+
+static int build_field_index(struct field_index *index, enum Field field, unsigned int max) {
+	unsigned int hash_size, capacity = 0;
+	unsigned int *hash;
+	uint64_t *set;
+	unsigned int value, m, w;
+	int res = -1;
+
+	// open addressing table of the classes found so far
+	for (hash_size = 1; hash_size < 2 * (max + 1); hash_size <<= 1);
+	hash = malloc(hash_size * sizeof(*hash));
+	set = malloc(set_words * sizeof(*set));
+	index->class_of = malloc((max + 1) * sizeof(*index->class_of));
+	index->classes = NULL;
+	index->class_count = 0;
+	if (hash == NULL || set == NULL || index->class_of == NULL) {
+		goto out;
 	}
+	memset(hash, 0xff, hash_size * sizeof(*hash));
 
-	// open the device using the VID and PID
-	handle = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
-	if (handle == NULL) {
-		fprintf(stderr, "hid_open() failed. Maybe device is not connected.\n");
-		exit(EXIT_FAILURE);
+	for (value = 0; value <= max; value++) {
+		uint64_t digest = 14695981039346656037ULL;
+		unsigned int slot;
+
+		memset(set, 0, set_words * sizeof(*set));
+		for (m = 0; m < mapping_count; m++) {
+			if (pattern_matches(field_pattern(&mappings[m], field), value)) {
+				set[m / 64] |= 1ULL << (m % 64);
+			}
+		}
+
+		for (w = 0; w < set_words; w++) {
+			digest = (digest ^ set[w]) * 1099511628211ULL;
+		}
+		slot = digest & (hash_size - 1);
+		while (hash[slot] != UINT32_MAX
+			&& memcmp(&index->classes[hash[slot] * set_words], set, set_words * sizeof(*set)) != 0) {
+			slot = (slot + 1) & (hash_size - 1);
+		}
+
+		if (hash[slot] == UINT32_MAX) {
+			// new class
+			if (index->class_count == capacity) {
+				uint64_t *classes;
+
+				capacity = capacity ? 2 * capacity : 16;
+				classes = realloc(index->classes, capacity * set_words * sizeof(*classes));
+				if (classes == NULL) {
+					goto out;
+				}
+				index->classes = classes;
+			}
+			memcpy(&index->classes[index->class_count * set_words], set, set_words * sizeof(*set));
+			hash[slot] = index->class_count;
+			index->class_count += 1;
+		}
+		index->class_of[value] = hash[slot];
 	}
+	res = 0;
 
-	// set the hid_read() function to be non-blocking
-	res = hid_set_nonblocking(handle, 1);
+out:
 	if (res != 0) {
-		fprintf(stderr, "hid_set_nonblocking() failed. Errorcode: %d\n", res);
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "Out of memory while indexing mappings.\n");
 	}
+	free(hash);
+	free(set);
+	return res;
+}
 
-	// handle the received program arguments
-	while ((option = getopt(argc, argv, "b::i::n::f::r::m::t::d::w::s::u::e::a::x::v")) != -1) {
-		switch (option) {
-			case 'b': // control the buttons
-				feature_bool(handle, ControlPcEnable, optarg);
-				break;
 
-			case 'i': // forward IR codes
-				feature_bool(handle, ForwardIrEnable, optarg);
-				break;
+static void free_field_index(struct field_index *index) {
+	free(index->class_of);
+	free(index->classes);
+	index->class_of = NULL;
+	index->classes = NULL;
+	index->class_count = 0;
+}
 
-			case 'n': // power on IR code
-				feature_ircode(handle, PowerOnCode, optarg);
-				break;
 
-			case 'f': // power off IR code
-				feature_ircode(handle, PowerOffCode, optarg);
-				break;
+int load_mappings(void) {
+	config_setting_t *list;
+	unsigned int count = 0;
+	unsigned int i, c;
 
-			case 'r': // reset IR code
-				feature_ircode(handle, ResetCode, optarg);
-				break;
+	// read settings
+	int value = false;
+	config_lookup_bool(&cfg, "settings.send_keys", &value);
+	send_keys = value;
 
-			case 'm': // minimum repeats
-				feature_bool(handle, MinRepeats, optarg);
-				break;
+	value = false;
+	config_lookup_bool(&cfg, "settings.start_apps", &value);
+	start_apps = value;
 
-			case 't': // date/time
-				feature_devicetime(handle, DeviceTime, optarg);
-				break;
+	value = false;
+	config_lookup_bool(&cfg, "settings.transmit_codes", &value);
+	transmit_codes = value;
 
-			case 'd': // clock deviation
-				feature_timedeviation(handle, ForwardIrEnable, optarg);
-				break;
+	list = config_lookup(&cfg, "mappings");
+	if (list != NULL) {
+		count = config_setting_length(list);
+	}
 
-			case 'w': // wakeup time
-				feature_waketime(handle, WakeupTime, optarg);
-				break;
+	// there are never more contexts than mappings, plus the global one
+	mappings = calloc(count ? count : 1, sizeof(*mappings));
+	contexts = calloc(count + 1, sizeof(*contexts));
+	if (mappings == NULL || contexts == NULL) {
+		fprintf(stderr, "Out of memory while loading mappings.\n");
+		return -1;
+	}
+	context_count = 1; // GLOBAL_CONTEXT
+	mapping_count = 0;
+
+	for (i = 0; i < count; i++) {
+		config_setting_t *mapping = config_setting_get_elem(list, i);
+		const char *window_class = NULL, *window_name = NULL;
+		struct mapping *entry = &mappings[mapping_count];
+		const char *transmit, *coalesce;
+
+		// if any of the settings doesn't exist, proceed to next mapping
+		if (parse_pattern(mapping, "ir_protocol", MAX_PROTOCOL, &entry->protocol) != 0
+			|| parse_pattern(mapping, "ir_address", MAX_ADDRESS, &entry->address) != 0
+			|| parse_pattern(mapping, "ir_command", MAX_COMMAND, &entry->command) != 0) {
+			fprintf(stderr, "Missing or invalid IR code in mapping %u. Mapping ignored.\n", i);
+			continue;
+		}
+		entry->command_base = entry->command.mask ? entry->command.bits : entry->command.low;
+		entry->codes = pattern_size(&entry->protocol, MAX_PROTOCOL)
+				* pattern_size(&entry->address, MAX_ADDRESS)
+				* pattern_size(&entry->command, MAX_COMMAND);
+		entry->order = i;
+
+		entry->priority = 0;
+		config_setting_lookup_int(mapping, "priority", &entry->priority);
+
+		entry->key = NULL;
+		config_setting_lookup_string(mapping, "key", &entry->key);
+
+		entry->application = NULL;
+		entry->parameter = NULL;
+		if (!(config_setting_lookup_string(mapping, "application", &entry->application)
+			&& config_setting_lookup_string(mapping, "parameter", &entry->parameter))) {
+			entry->application = NULL;
+		}
 
-			case 's': // wakeup time span
-				feature_bool(handle, WakeupTimeSpan, optarg);
-				break;
+		// opt-in, so a '%' in existing mappings keeps its meaning
+		value = false;
+		config_setting_lookup_bool(mapping, "placeholders", &value);
+		entry->placeholders = value;
+
+		// build the report to be transmitted right away
+		entry->transmit = false;
+		entry->transmit_priority = 0;
+		if (config_setting_lookup_string(mapping, "transmit", &transmit)) {
+			if (parse_ircode_report(transmit, entry->transmit_report) != 0) {
+				fprintf(stderr, "Invalid transmit code in mapping %u: %s\n", i, transmit);
+				continue;
+			}
+			entry->transmit = true;
 
-			case 'u': // start firmware update mode by writing 0x5a as first data byte
-				feature_bool(handle, RequestBootloader, optarg);
-				break;
+			config_setting_lookup_int(mapping, "transmit_priority", &entry->transmit_priority);
+			if (entry->transmit_priority < 0) {
+				entry->transmit_priority = 0;
+			}
+			else if (entry->transmit_priority >= TX_PRIORITIES) {
+				entry->transmit_priority = TX_PRIORITIES-1;
+			}
+		}
 
-			case 'e': // enable watchdog
-				feature_bool(handle, WatchdogEnable, optarg);
-				break;
+		entry->coalesce = CoalesceNone;
+		if (config_setting_lookup_string(mapping, "coalesce", &coalesce)) {
+			if (strcmp(coalesce, "collapse") == 0) {
+				entry->coalesce = CoalesceCollapse;
+			}
+			else if (strcmp(coalesce, "latest") == 0) {
+				entry->coalesce = CoalesceLatest;
+			}
+			else if (strcmp(coalesce, "count") == 0) {
+				entry->coalesce = CoalesceCount;
+			}
+			else if (strcmp(coalesce, "none") != 0) {
+				fprintf(stderr, "Unknown coalesce policy in mapping %u: %s\n", i, coalesce);
+			}
+		}
 
-			case 'a': // service watchdog
-				feature_bool(handle, WatchdogReset, optarg);
+		// find the window scope or add a new one
+		config_setting_lookup_string(mapping, "window_class", &window_class);
+		config_setting_lookup_string(mapping, "window_name", &window_name);
+		for (c = 0; c < context_count; c++) {
+			if (str_equal(contexts[c].window_class, window_class)
+				&& str_equal(contexts[c].window_name, window_name)) {
 				break;
+			}
+		}
+		if (c == context_count) {
+			contexts[c].window_class = window_class;
+			contexts[c].window_name = window_name;
+			context_count += 1;
+		}
+		entry->context = c;
 
-			case 'x': // transmit custom code
-				send_ircode(handle, optarg);
-				break;
+		mapping_count += 1;
+	}
 
-			case 'v': // verbose mode
-				verbose = true;
-				break;
+	// the bit order of the bitsets is the order of precedence
+	qsort(mappings, mapping_count, sizeof(*mappings), compare_precedence);
+	set_words = (mapping_count + 63) / 64;
+	if (set_words == 0) {
+		set_words = 1;
+	}
 
-			case '?': // help
-				fprintf(stdout, "Some help text missing.\n");
-				break;
+	context_sets = calloc(context_count * set_words, sizeof(*context_sets));
+	if (context_sets == NULL) {
+		fprintf(stderr, "Out of memory while loading mappings.\n");
+		return -1;
+	}
+	for (i = 0; i < mapping_count; i++) {
+		context_sets[mappings[i].context * set_words + i / 64] |= 1ULL << (i % 64);
+	}
 
-			default:
-				fprintf(stderr, "Unknown option: %c\n", option);
-				exit(EXIT_FAILURE);
-		} // switch (option)
-	} // while ((option = getopt(argc, argv, "...")) != -1)
+	if (build_field_index(&protocol_index, FieldProtocol, MAX_PROTOCOL) != 0
+		|| build_field_index(&address_index, FieldAddress, MAX_ADDRESS) != 0
+		|| build_field_index(&command_index, FieldCommand, MAX_COMMAND) != 0) {
+		return -1;
+	}
 
-	if (verbose == true) {
-		show_device_details(handle);
+	return 0;
+}
+
+
+void free_mappings(void) {
+	free_field_index(&protocol_index);
+	free_field_index(&address_index);
+	free_field_index(&command_index);
+	free(context_sets);
+	free(mappings);
+	free(contexts);
+	context_sets = NULL;
+	mappings = NULL;
+	contexts = NULL;
+	mapping_count = 0;
+	context_count = 0;
+}
+
+
+// threads get a small stack instead of the default 8 MiB, because mlockall()
+// of the low latency profile pins every stack completely
+static int create_thread(pthread_t *thread, size_t stack_size, void *(*start)(void *), void *arg) {
+	pthread_attr_t attr;
+	int res;
+
+	res = pthread_attr_init(&attr);
+	if (res != 0) {
+		return res;
+	}
+	res = pthread_attr_setstacksize(&attr, stack_size);
+	if (res == 0) {
+		res = pthread_create(thread, &attr, start, arg);
+	}
+	pthread_attr_destroy(&attr);
+	return res;
+}
+
+
+static unsigned int match_context(const char *res_name, const char *res_class, const char *title) {
+	unsigned int c;
+
+	// the first scoped context matching the window wins
+	for (c = GLOBAL_CONTEXT + 1; c < context_count; c++) {
+		const struct context *ctx = &contexts[c];
+
+		if (ctx->window_class != NULL
+			&& !(res_class && strcasecmp(ctx->window_class, res_class) == 0)
+			&& !(res_name && strcasecmp(ctx->window_class, res_name) == 0)) {
+			continue;
+		}
+		if (ctx->window_name != NULL
+			&& !(title && strstr(title, ctx->window_name))) {
+			continue;
+		}
+		return c;
+	}
+	return GLOBAL_CONTEXT;
+}
+
+
+static int ignore_x_errors(Display *dpy, XErrorEvent *error) {
+	// the focused window may vanish at any time, which results in BadWindow
+	// errors for the requests of the focus thread. they are harmless.
+	(void)dpy;
+	if (error->error_code != BadWindow) {
+		fprintf(stderr, "X error. Errorcode: %d\n", error->error_code);
+	}
+	return 0;
+}
+
+
+static Window get_active_window(Display *dpy, Window root, Atom net_active_window) {
+	Atom type;
+	int format;
+	unsigned long items, bytes_left;
+	unsigned char *data = NULL;
+	Window active = None;
+
+	if (XGetWindowProperty(dpy, root, net_active_window, 0, 1, False, XA_WINDOW,
+			&type, &format, &items, &bytes_left, &data) == Success
+		&& data != NULL && items == 1) {
+		active = *(Window *)data;
+	}
+	if (data != NULL) {
+		XFree(data);
+	}
+	return active;
+}
+
+
+static Window update_focused_context(Display *dpy, Window root, Window previous,
+		Atom net_active_window, Atom net_wm_name, Atom utf8_string) {
+	Window active;
+	XClassHint hint = { NULL, NULL };
+	unsigned char *title = NULL;
+	char *fallback_title = NULL;
+	unsigned int context = GLOBAL_CONTEXT;
+
+	active = get_active_window(dpy, root, net_active_window);
+
+	// follow title and class changes of the focused window only
+	if (active != previous) {
+		if (previous != None) {
+			XSelectInput(dpy, previous, NoEventMask);
+		}
+		if (active != None) {
+			XSelectInput(dpy, active, PropertyChangeMask);
+		}
+	}
+
+	if (active != None) {
+		Atom type;
+		int format;
+		unsigned long items, bytes_left;
+
+		XGetClassHint(dpy, active, &hint);
+		if (XGetWindowProperty(dpy, active, net_wm_name, 0, MAX_STRING_LENGTH, False, utf8_string,
+				&type, &format, &items, &bytes_left, &title) != Success || title == NULL) {
+			title = NULL;
+			XFetchName(dpy, active, &fallback_title);
+		}
+
+		context = match_context(hint.res_name, hint.res_class,
+				title ? (const char *)title : fallback_title);
+	}
+
+	atomic_store(&focused_context, context);
+
+	if (hint.res_name != NULL) {
+		XFree(hint.res_name);
+	}
+	if (hint.res_class != NULL) {
+		XFree(hint.res_class);
+	}
+	if (title != NULL) {
+		XFree(title);
+	}
+	if (fallback_title != NULL) {
+		XFree(fallback_title);
+	}
+	return active;
+}
+
+
+static void *focus_thread_main(void *arg) {
+	Display *dpy = arg;
+	Window root = DefaultRootWindow(dpy);
+	Atom net_active_window = XInternAtom(dpy, "_NET_ACTIVE_WINDOW", False);
+	Atom net_wm_name = XInternAtom(dpy, "_NET_WM_NAME", False);
+	Atom utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
+	Window active;
+	XEvent event;
+
+	XSelectInput(dpy, root, PropertyChangeMask);
+	active = update_focused_context(dpy, root, None, net_active_window, net_wm_name, utf8_string);
+
+	for (;;) {
+		XNextEvent(dpy, &event);
+		if (event.type != PropertyNotify) {
+			continue;
+		}
+
+		if ((event.xproperty.window == root && event.xproperty.atom == net_active_window)
+			|| (event.xproperty.window == active
+				&& (event.xproperty.atom == net_wm_name
+					|| event.xproperty.atom == XA_WM_NAME
+					|| event.xproperty.atom == XA_WM_CLASS))) {
+			active = update_focused_context(dpy, root, active, net_active_window, net_wm_name, utf8_string);
+		}
+	}
+	return NULL;
+}
+
+
+int start_focus_tracking(void) {
+	Display *dpy;
+	int res;
+
+	// without scoped mappings there is nothing to track
+	if (context_count <= 1) {
+		return 0;
+	}
+
+	// the thread uses its own connection so it never contends with xdo
+	dpy = XOpenDisplay(NULL);
+	if (dpy == NULL) {
+		fprintf(stderr, "XOpenDisplay() failed. Window specific mappings are disabled.\n");
+		return -1;
+	}
+	XSetErrorHandler(ignore_x_errors);
+
+	res = create_thread(&focus_thread, THREAD_STACK_SIZE, focus_thread_main, dpy);
+	if (res != 0) {
+		fprintf(stderr, "Starting focus tracking failed. Errorcode: %d\n", res);
+		XCloseDisplay(dpy);
+		return -1;
+	}
+	focus_thread_running = true;
+	return 0;
+}
+
+
+void stop_focus_tracking(void) {
+	if (focus_thread_running) {
+		// the thread blocks in XNextEvent, so it has to be cancelled. its
+		// display connection is closed along with the process.
+		pthread_cancel(focus_thread);
+		pthread_join(focus_thread, NULL);
+		focus_thread_running = false;
+	}
+}
+
+
+void load_runtime_profile(void) {
+	int value;
+	const char *policy;
+
+	value = false;
+	config_lookup_bool(&cfg, "settings.low_latency", &value);
+	profile.enable = value;
+
+	if (config_lookup_string(&cfg, "settings.rt_policy", &policy)) {
+		if (strcasecmp(policy, "rr") == 0) {
+			profile.policy = SCHED_RR;
+		}
+		else if (strcasecmp(policy, "fifo") == 0) {
+			profile.policy = SCHED_FIFO;
+		}
+		else {
+			fprintf(stderr, "Unknown rt_policy: %s. Using fifo.\n", policy);
+		}
+	}
+
+	config_lookup_int(&cfg, "settings.rt_priority", &profile.priority);
+	config_lookup_int(&cfg, "settings.rt_cpu", &profile.cpu);
+}
+
+
+static void prefault_stack(void) {
+	volatile unsigned char stack[PREFAULT_STACK_SIZE];
+	unsigned int i;
+
+	// touch every page once, mlockall keeps them resident afterwards
+	for (i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+
+int apply_runtime_profile(void) {
+	struct sched_param param;
+	int res = 0;
+
+	// keep freed heap memory mapped, so it stays locked and is reused
+	// without page faults
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		perror("mlockall() failed");
+		res = -1;
+	}
+	prefault_stack();
+
+	if (profile.cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(profile.cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+			perror("sched_setaffinity() failed");
+			res = -1;
+		}
+	}
+
+	// applies to the calling thread only. applications started by system()
+	// fall back to the normal policy because of SCHED_RESET_ON_FORK.
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = profile.priority;
+	if (sched_setscheduler(0, profile.policy | SCHED_RESET_ON_FORK, &param) != 0) {
+		perror("sched_setscheduler() failed");
+		res = -1;
+	}
+
+	return res;
+}
+
+
+static atomic_bool load_running;
+
+static void *load_thread_main(void *arg) {
+	volatile unsigned long counter = 0;
+
+	(void)arg;
+	while (atomic_load_explicit(&load_running, memory_order_relaxed)) {
+		counter += 1;
+	}
+	return NULL;
+}
+
+
+static int compare_long(const void *a, const void *b) {
+	long la = *(const long *)a, lb = *(const long *)b;
+	return (la > lb) - (la < lb);
+}
+
+
+int measure_jitter(char *arg) {
+	int seconds = 10;
+	long cpus, started, i, samples;
+	int res;
+	long *latency;
+	pthread_t *load;
+	unsigned long histogram[JITTER_BUCKETS];
+	struct timespec next, now;
+	double sum = 0;
+
+	if (arg && *arg) {
+		seconds = atoi(&arg[1]); // arg[0] is '='
+	}
+	if (seconds < 1) {
+		fprintf(stderr, "Invalid measurement duration: %d\n", seconds);
+		return -1;
+	}
+
+	// preallocate the sample buffer
+	samples = seconds * (1000L*1000*1000 / JITTER_PERIOD_NS);
+	latency = calloc(samples, sizeof(*latency));
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	load = calloc(cpus, sizeof(*load));
+	if (latency == NULL || load == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(latency);
+		free(load);
+		return -1;
+	}
+
+	// touch every page once, so the measurement takes no page faults
+	for (i = 0; i < samples; i += 4096 / sizeof(*latency)) {
+		((volatile long *)latency)[i] = 0;
+	}
+
+	// one busy thread per CPU as synthetic load. they are started before
+	// the profile is applied, so they keep the normal policy.
+	atomic_store(&load_running, true);
+	for (started = 0; started < cpus; started++) {
+		res = create_thread(&load[started], LOAD_STACK_SIZE, load_thread_main, NULL);
+		if (res != 0) {
+			fprintf(stderr, "Starting load thread failed. Errorcode: %d\n", res);
+			break;
+		}
+	}
+
+	if (profile.enable) {
+		apply_runtime_profile();
+	}
+
+	fprintf(stdout, "Measuring timer wakeup latency for %d s with %ld load threads, low_latency %s.\n",
+			seconds, started, profile.enable ? "enabled" : "disabled");
+
+	// wake up from a timer and take the time. this is a proxy for how fast
+	// the scheduler gets the reader running once its read() of the hidraw
+	// device returns, not a measurement of the USB path itself
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < samples; i++) {
+		next.tv_nsec += JITTER_PERIOD_NS;
+		if (next.tv_nsec >= 1000L*1000*1000) {
+			next.tv_nsec -= 1000L*1000*1000;
+			next.tv_sec += 1;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency[i] = (now.tv_sec - next.tv_sec) * 1000L*1000*1000 + (now.tv_nsec - next.tv_nsec);
+	}
+
+	atomic_store(&load_running, false);
+	for (i = 0; i < started; i++) {
+		pthread_join(load[i], NULL);
+	}
+
+	// evaluate
+	memset(histogram, 0, sizeof(histogram));
+	for (i = 0; i < samples; i++) {
+		long us = latency[i] / 1000;
+		int bucket = 0;
+
+		while (us > 0 && bucket < JITTER_BUCKETS-1) {
+			us >>= 1;
+			bucket += 1;
+		}
+		histogram[bucket] += 1;
+		sum += latency[i];
+	}
+	qsort(latency, samples, sizeof(*latency), compare_long);
+
+	fprintf(stdout, "min: %ld us, avg: %.1f us, max: %ld us\n",
+			latency[0] / 1000, sum / samples / 1000, latency[samples-1] / 1000);
+	fprintf(stdout, "p50: %ld us, p90: %ld us, p99: %ld us, p99.9: %ld us\n",
+			latency[samples*50/100] / 1000, latency[samples*90/100] / 1000,
+			latency[samples*99/100] / 1000, latency[samples*999/1000] / 1000);
+	for (i = 0; i < JITTER_BUCKETS; i++) {
+		if (histogram[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			fprintf(stdout, "      < 1 us: %lu\n", histogram[i]);
+		}
+		else {
+			fprintf(stdout, "%5ld - %5ld us: %lu\n", 1L << (i-1), (1L << i) - 1, histogram[i]);
+		}
+	}
+
+	free(latency);
+	free(load);
+	return 0;
+}
+
+
+// the queues are shared by the reader, which may run with realtime priority,
+// and threads of normal priority. priority inheritance keeps the reader from
+// waiting for such a thread that was preempted while holding the lock.
+static int init_queue_lock(pthread_mutex_t *lock) {
+	pthread_mutexattr_t attr;
+	int res;
+
+	res = pthread_mutexattr_init(&attr);
+	if (res != 0) {
+		return res;
+	}
+	res = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	if (res == 0) {
+		res = pthread_mutex_init(lock, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+	return res;
+}
+
+
+void tx_enqueue(const unsigned char *frame, int priority) {
+	pthread_mutex_lock(&tx.lock);
+	if (tx.count[priority] < TX_QUEUE_LENGTH) {
+		unsigned int tail = (tx.head[priority] + tx.count[priority]) % TX_QUEUE_LENGTH;
+
+		tx.frames[priority][tail] = frame;
+		tx.count[priority] += 1;
+		pthread_cond_signal(&tx.ready);
+	}
+	else {
+		fprintf(stderr, "Transmit queue full. Frame dropped.\n");
+	}
+	pthread_mutex_unlock(&tx.lock);
+}
+
+
+static void *tx_thread_main(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&tx.lock);
+	for (;;) {
+		const unsigned char *frame = NULL;
+		int priority;
+		int res;
+
+		// take the oldest frame of the highest priority
+		for (priority = TX_PRIORITIES-1; priority >= 0; priority--) {
+			if (tx.count[priority] > 0) {
+				frame = tx.frames[priority][tx.head[priority]];
+				tx.head[priority] = (tx.head[priority] + 1) % TX_QUEUE_LENGTH;
+				tx.count[priority] -= 1;
+				break;
+			}
+		}
+
+		if (frame == NULL) {
+			if (tx.stop) {
+				break;
+			}
+			pthread_cond_wait(&tx.ready, &tx.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&tx.lock);
+
+		// hidapi isn't thread-safe for a single device, so the transmitter
+		// writes through its own handle. it is reopened after a disconnect,
+		// frames are dropped meanwhile.
+		if (tx_handle == NULL) {
+			pthread_mutex_lock(&open_lock);
+			tx_handle = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
+			pthread_mutex_unlock(&open_lock);
+		}
+		res = tx_handle ? hid_write(tx_handle, frame, IR_REPORT_LENGTH) : -1;
+		if (res < 1) {
+			fprintf(stderr, "Error writing ReportID: %d. Errorcode: %d\n", frame[0], res);
+			if (tx_handle != NULL) {
+				pthread_mutex_lock(&open_lock);
+				hid_close(tx_handle);
+				tx_handle = NULL;
+				pthread_mutex_unlock(&open_lock);
+			}
+		}
+
+		pthread_mutex_lock(&tx.lock);
+	}
+	pthread_mutex_unlock(&tx.lock);
+	return NULL;
+}
+
+
+int start_transmitter(void) {
+	int res;
+
+	if (!transmit_codes) {
+		return 0;
+	}
+
+	res = init_queue_lock(&tx.lock);
+	if (res != 0) {
+		fprintf(stderr, "Initializing transmit queue failed. Errorcode: %d\n", res);
+		transmit_codes = false;
+		return -1;
+	}
+
+	// the reader's handle is never shared. the transmitter doesn't read, so
+	// its handle only ever buffers a few input reports in the kernel.
+	tx_handle = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
+	if (tx_handle == NULL) {
+		fprintf(stderr, "hid_open() for the transmitter failed. Transmitting is disabled.\n");
+		transmit_codes = false;
+		return -1;
+	}
+
+	res = create_thread(&tx_thread, THREAD_STACK_SIZE, tx_thread_main, NULL);
+	if (res != 0) {
+		fprintf(stderr, "Starting transmitter failed. Errorcode: %d\n", res);
+		hid_close(tx_handle);
+		tx_handle = NULL;
+		transmit_codes = false;
+		return -1;
+	}
+	tx_thread_running = true;
+	return 0;
+}
+
+
+int boost_transmitter(void) {
+	struct sched_param param;
+	int res;
+
+	if (!tx_thread_running) {
+		return 0;
+	}
+
+	// threads don't inherit the reader's policy because of
+	// SCHED_RESET_ON_FORK, so the transmitter is set explicitly
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = profile.priority;
+	res = pthread_setschedparam(tx_thread, profile.policy, &param);
+	if (res != 0) {
+		fprintf(stderr, "Boosting transmitter failed. Errorcode: %d\n", res);
+		return -1;
+	}
+	return 0;
+}
+
+
+void stop_transmitter(void) {
+	if (tx_thread_running) {
+		// pending frames are still sent
+		pthread_mutex_lock(&tx.lock);
+		tx.stop = true;
+		pthread_cond_signal(&tx.ready);
+		pthread_mutex_unlock(&tx.lock);
+
+		pthread_join(tx_thread, NULL);
+		tx_thread_running = false;
+
+		if (tx_handle != NULL) {
+			hid_close(tx_handle);
+			tx_handle = NULL;
+		}
+	}
+}
+
+
+// if enabled for the mapping, replace %p, %a, %c by the received protocol,
+// address and command and %i by the command's offset in the matching range,
+// e.g. the digit
+static const char *expand_placeholders(const char *format, const struct mapping *mapping,
+		const struct ircode *ir_code, char *buf, size_t size) {
+	size_t len = 0;
+
+	if (!mapping->placeholders || strchr(format, '%') == NULL) {
+		return format;
+	}
+
+	while (*format && len + 1 < size) {
+		int res = 0;
+
+		// any other sequence is kept as it is
+		if (format[0] != '%' || format[1] == '\0' || strchr("paci%", format[1]) == NULL) {
+			buf[len++] = *format++;
+			continue;
+		}
+		switch (format[1]) {
+			case 'p':
+				res = snprintf(&buf[len], size - len, "0x%02hhx", ir_code->protocol);
+				break;
+			case 'a':
+				res = snprintf(&buf[len], size - len, "0x%04hx", ir_code->address);
+				break;
+			case 'c':
+				res = snprintf(&buf[len], size - len, "0x%04hx", ir_code->command);
+				break;
+			case 'i':
+				res = snprintf(&buf[len], size - len, "%u", ir_code->command - mapping->command_base);
+				break;
+			case '%':
+				buf[len] = '%';
+				res = 1;
+				break;
+		}
+		if (res < 0 || (size_t)res >= size - len) {
+			// truncated
+			len = size - 1;
+			break;
+		}
+		len += res;
+		format += 2;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+
+void run_mapping(const struct mapping *mapping, const struct ircode *ir_code, unsigned int repeat) {
+	// send key (sequence) if there is any and this feature is enabled. xdo
+	// can't send a sequence repeatedly in one call, so coalesced keys are
+	// sent once and repeat only applies to applications
+	if (send_keys && mapping->key != NULL) {
+		char key[MAX_STRING_LENGTH];
+		xdo_send_keysequence_window(x, CURRENTWINDOW,
+				expand_placeholders(mapping->key, mapping, ir_code, key, sizeof(key)), 2000);
+	}
+
+	// start app if there is any and this feature is enabled
+	if (start_apps && mapping->application != NULL) {
+		char call[256], parameter[MAX_STRING_LENGTH];
+		const char *expanded = expand_placeholders(mapping->parameter, mapping, ir_code,
+				parameter, sizeof(parameter));
+		if (mapping->coalesce == CoalesceCount) {
+			// pass the number of coalesced actions to the application
+			snprintf(call, sizeof(call), "HIDIRT_REPEAT=%u %s %s",
+					repeat, mapping->application, expanded);
+		}
+		else {
+			snprintf(call, sizeof(call), "%s %s", mapping->application, expanded);
+		}
+		system(call);
+	}
+}
+
+
+void action_enqueue(const struct mapping *mapping, const struct ircode *ir_code) {
+	unsigned int tail;
+
+	pthread_mutex_lock(&aq.lock);
+	if (aq.count < ACTION_QUEUE_LENGTH) {
+		tail = (aq.head + aq.count) % ACTION_QUEUE_LENGTH;
+		aq.actions[tail].mapping = mapping;
+		aq.actions[tail].ir_code = *ir_code;
+		aq.count += 1;
+		pthread_cond_signal(&aq.ready);
+	}
+	else {
+		fprintf(stderr, "Action queue full. Action dropped.\n");
+	}
+	pthread_mutex_unlock(&aq.lock);
+}
+
+
+static bool same_ircode(const struct ircode *a, const struct ircode *b) {
+	return a->protocol == b->protocol
+		&& a->address == b->address
+		&& a->command == b->command;
+}
+
+
+static void run_action_batch(unsigned int count) {
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++) {
+		const struct mapping *mapping = action_batch[i].mapping;
+		unsigned int repeat = 1;
+		bool superseded = false;
+
+		if (mapping == NULL) {
+			// already coalesced into an earlier action
+			continue;
+		}
+
+		switch (mapping->coalesce) {
+			case CoalesceNone:
+				break;
+
+			case CoalesceCollapse:
+			case CoalesceCount:
+				// take the identical actions that are pending, too
+				for (j = i + 1; j < count; j++) {
+					if (action_batch[j].mapping == mapping
+						&& same_ircode(&action_batch[j].ir_code, &action_batch[i].ir_code)) {
+						action_batch[j].mapping = NULL;
+						repeat += 1;
+					}
+				}
+				break;
+
+			case CoalesceLatest:
+				// skip this action if a newer one of the mapping is pending
+				for (j = i + 1; j < count; j++) {
+					if (action_batch[j].mapping == mapping) {
+						superseded = true;
+						break;
+					}
+				}
+				break;
+		}
+
+		if (!superseded) {
+			run_mapping(mapping, &action_batch[i].ir_code, repeat);
+		}
+	}
+}
+
+
+static void *action_thread_main(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&aq.lock);
+	for (;;) {
+		unsigned int count, i;
+
+		while (aq.count == 0 && !aq.stop) {
+			pthread_cond_wait(&aq.ready, &aq.lock);
+		}
+		if (aq.stop) {
+			break;
+		}
+
+		// take all pending actions, so the reader can go on queueing
+		count = aq.count;
+		for (i = 0; i < count; i++) {
+			action_batch[i] = aq.actions[(aq.head + i) % ACTION_QUEUE_LENGTH];
+		}
+		aq.head = (aq.head + count) % ACTION_QUEUE_LENGTH;
+		aq.count = 0;
+		pthread_mutex_unlock(&aq.lock);
+
+		run_action_batch(count);
+
+		pthread_mutex_lock(&aq.lock);
+	}
+	pthread_mutex_unlock(&aq.lock);
+	return NULL;
+}
+
+
+int start_action_thread(void) {
+	int res;
+
+	res = init_queue_lock(&aq.lock);
+	if (res != 0) {
+		fprintf(stderr, "Initializing action queue failed. Errorcode: %d\n", res);
+		return -1;
+	}
+
+	res = create_thread(&action_thread, THREAD_STACK_SIZE, action_thread_main, NULL);
+	if (res != 0) {
+		fprintf(stderr, "Starting action thread failed. Errorcode: %d\n", res);
+		return -1;
+	}
+	action_thread_running = true;
+	return 0;
+}
+
+
+void stop_action_thread(void) {
+	if (action_thread_running) {
+		// pending actions are discarded
+		pthread_mutex_lock(&aq.lock);
+		aq.stop = true;
+		pthread_cond_signal(&aq.ready);
+		pthread_mutex_unlock(&aq.lock);
+
+		pthread_join(action_thread, NULL);
+		action_thread_running = false;
+	}
+}
+
+
+static bool dispatch_set(const uint64_t *protocols, const uint64_t *addresses,
+		const uint64_t *commands, const uint64_t *scope, const struct ircode *ir_code) {
+	const struct mapping *best = NULL;
+	unsigned int w;
+
+	for (w = 0; w < set_words; w++) {
+		uint64_t matches = protocols[w] & addresses[w] & commands[w] & scope[w];
+
+		while (matches != 0) {
+			const struct mapping *mapping = &mappings[w * 64 + __builtin_ctzll(matches)];
+			matches &= matches - 1;
+
+			// sorted by precedence, so only the leading equal ones are run
+			if (best != NULL
+				&& (mapping->priority != best->priority || mapping->codes != best->codes)) {
+				return true;
+			}
+			best = mapping;
+
+			// translated frames go out right away
+			if (transmit_codes && mapping->transmit) {
+				tx_enqueue(mapping->transmit_report, mapping->transmit_priority);
+			}
+
+			// keys and applications are handled by the action thread
+			if (action_thread_running && (mapping->key != NULL || mapping->application != NULL)) {
+				action_enqueue(mapping, ir_code);
+			}
+		}
+	}
+	return best != NULL;
+}
+
+
+void handle_ir_code(struct ircode* ir_code) {
+	unsigned int context = atomic_load(&focused_context);
+	const uint64_t *protocols, *addresses, *commands;
+
+	// one bitset per field, the matching mappings are their intersection
+	protocols = &protocol_index.classes[protocol_index.class_of[ir_code->protocol] * set_words];
+	addresses = &address_index.classes[address_index.class_of[ir_code->address] * set_words];
+	commands = &command_index.classes[command_index.class_of[ir_code->command] * set_words];
+
+	// mappings scoped to the focused window take precedence over global ones
+	if (context != GLOBAL_CONTEXT
+		&& dispatch_set(protocols, addresses, commands, &context_sets[context * set_words], ir_code)) {
+		return;
+	}
+	dispatch_set(protocols, addresses, commands, &context_sets[GLOBAL_CONTEXT * set_words], ir_code);
+}
+
+
+void cleanup(void) {
+	int res;
+
+	// stop following the focused window
+	stop_focus_tracking();
+
+	// stop handling keys and applications
+	stop_action_thread();
+
+	// send the pending frames and stop the transmitter
+	stop_transmitter();
+
+	// free the compiled mappings
+	free_mappings();
+
+	// close xdo
+	xdo_free(x);
+
+	// close the config
+	config_destroy(&cfg);
+
+	// close the device
+	if (handle != NULL) {
+		hid_close(handle);
+	}
+
+	// finalize the hidapi library
+	res = hid_exit();
+	if (res != 0) {
+		fprintf(stderr, "hid_exit() failed. Errorcode: %d\n", res);
+	}
+}
+
+
+int main(int argc, char* argv[]) {
+	int res;
+	char option;
+	bool verbose = false;
+	char *firmware = NULL, *simulation = NULL;
+	bool update = false, simulate = false;
+	char *jitter = NULL;
+	bool measure = false;
+
+	// the focus thread and xdo use Xlib concurrently
+	XInitThreads();
+
+	// prepare xdo and config
+	x = xdo_new(NULL);
+	config_init(&cfg);
+
+	// try to read config file or create one if none exists
+	if (access(config_file, R_OK) == 0) {
+		// file exists
+		// read the file. if there is an error, report it and exit
+		if (!config_read_file(&cfg, config_file)) {
+			fprintf(stderr, "Error reading config file %s, line %d - %s\n",
+					config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
+			config_destroy(&cfg);
+			exit(EXIT_FAILURE);
+		}
+	}
+	else {
+		// file doesn't exist
+		create_config_file();
+	}
+
+	// compile the mappings
+	if (load_mappings() != 0) {
+		config_destroy(&cfg);
+		exit(EXIT_FAILURE);
+	}
+	load_runtime_profile();
+
+	// register cleanup function
+	res = atexit(cleanup);
+	if (res != 0) {
+		fprintf(stderr, "Registering cleanup failed. Errorcode: %d\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	// initialize the hidapi library
+	res = hid_init();
+	if (res != 0) {
+		fprintf(stderr, "hid_init() failed. Errorcode: %d\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	// the firmware update is handled before opening the device, because the
+	// device isn't available as HID device while it is in DFU mode. the
+	// jitter measurement doesn't need the device at all.
+	opterr = 0;
+	while ((option = getopt(argc, argv, options)) != -1) {
+		if (option == 'U') {
+			firmware = optarg;
+			update = true;
+		}
+		else if (option == 'S') {
+			simulation = optarg;
+			simulate = true;
+		}
+		else if (option == 'j') {
+			jitter = optarg;
+			measure = true;
+		}
+	}
+	opterr = 1;
+	optind = 1;
+
+	// the arguments are optional for getopt, so "-U file" leaves them empty
+	if (update && firmware == NULL) {
+		fprintf(stderr, "Option -U requires a file, e.g. -U=firmware.bin\n");
+		exit(EXIT_FAILURE);
+	}
+	if (simulate && simulation == NULL) {
+		fprintf(stderr, "Option -S requires a file, e.g. -S=flash.bin\n");
+		exit(EXIT_FAILURE);
+	}
+	if (simulate && !update) {
+		fprintf(stderr, "Option -S requires option -U.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (update) {
+		res = update_firmware(firmware, simulation);
+		exit(res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (measure) {
+		res = measure_jitter(jitter);
+		exit(res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// open the device using the VID and PID
+	handle = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
+	if (handle == NULL) {
+		fprintf(stderr, "hid_open() failed. Maybe device is not connected.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// set the hid_read() function to be non-blocking
+	res = hid_set_nonblocking(handle, 1);
+	if (res != 0) {
+		fprintf(stderr, "hid_set_nonblocking() failed. Errorcode: %d\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	// handle the received program arguments
+	while ((option = getopt(argc, argv, options)) != -1) {
+		switch (option) {
+			case 'b': // control the buttons
+				feature_bool(handle, ControlPcEnable, optarg);
+				break;
+
+			case 'i': // forward IR codes
+				feature_bool(handle, ForwardIrEnable, optarg);
+				break;
+
+			case 'n': // power on IR code
+				feature_ircode(handle, PowerOnCode, optarg);
+				break;
+
+			case 'f': // power off IR code
+				feature_ircode(handle, PowerOffCode, optarg);
+				break;
+
+			case 'r': // reset IR code
+				feature_ircode(handle, ResetCode, optarg);
+				break;
+
+			case 'm': // minimum repeats
+				feature_bool(handle, MinRepeats, optarg);
+				break;
+
+			case 't': // date/time
+				feature_devicetime(handle, DeviceTime, optarg);
+				break;
+
+			case 'd': // clock deviation
+				feature_timedeviation(handle, ForwardIrEnable, optarg);
+				break;
+
+			case 'w': // wakeup time
+				feature_waketime(handle, WakeupTime, optarg);
+				break;
+
+			case 's': // wakeup time span
+				feature_bool(handle, WakeupTimeSpan, optarg);
+				break;
+
+			case 'u': // start firmware update mode by writing 0x5a as first data byte
+				feature_bool(handle, RequestBootloader, optarg);
+				break;
+
+			case 'e': // enable watchdog
+				feature_bool(handle, WatchdogEnable, optarg);
+				break;
+
+			case 'a': // service watchdog
+				feature_bool(handle, WatchdogReset, optarg);
+				break;
+
+			case 'x': // transmit custom code
+				send_ircode(handle, optarg);
+				break;
+
+			case 'j': // jitter measurement, handled before
+			case 'U': // firmware update, handled before
+			case 'S': // simulated DFU device, handled before
+				break;
+
+			case 'v': // verbose mode
+				verbose = true;
+				break;
+
+			case '?': // help
+				fprintf(stdout, "Some help text missing.\n");
+				break;
+
+			default:
+				fprintf(stderr, "Unknown option: %c\n", option);
+				exit(EXIT_FAILURE);
+		} // switch (option)
+	} // while ((option = getopt(argc, argv, "...")) != -1)
+
+	if (verbose == true) {
+		show_device_details(handle);
 	} // if (verbose == true)
 
+	if ((argc <= 1) || (verbose == true)) {
+		// follow the focused window for window specific mappings
+		start_focus_tracking();
+
+		// send keys and start applications apart from the reader
+		start_action_thread();
+
+		// send translated IR codes apart from the reader
+		start_transmitter();
+
+		// threads started so far keep the normal policy and all CPUs. only
+		// the reader and the transmitter get the realtime priority.
+		if (profile.enable) {
+			apply_runtime_profile();
+			boost_transmitter();
+		}
+	}
+
 	while ((argc <= 1) || (verbose == true)) {
 		unsigned char buf[MAX_FEATURE_REPORT_LENGTH];
 		struct ircode ir_code;
 
-		usleep(25*1000); // USB polling interval is 25ms
-		res = hid_read(handle, buf, sizeof(buf));
+		if (profile.enable) {
+			// block until the report arrives instead of polling
+			res = hid_read_timeout(handle, buf, sizeof(buf), -1);
+		}
+		else {
+			usleep(25*1000); // USB polling interval is 25ms
+			res = hid_read(handle, buf, sizeof(buf));
+		}
 
 		if (res < 0) {
 			fprintf(stderr, "hid_read() failed. Maybe device was disconnected. Errorcode: %d\n", res);
 			fprintf(stderr, "Trying to reconnect.\n");
 
-			// close the device
+			// close the device, the transmitter reopens its own handle
+			pthread_mutex_lock(&open_lock);
 			hid_close(handle);
+			handle = NULL;
+			pthread_mutex_unlock(&open_lock);
 
 			// try to reconnect
 			while (res != 0) {
 				usleep(500*1000);
 
 				// reopen the device using the VID and PID
+				pthread_mutex_lock(&open_lock);
 				handle = hid_open(HIDIRT_VID, HIDIRT_PID, NULL);
+				pthread_mutex_unlock(&open_lock);
 				if (handle != NULL) {
 					// set the hid_read() function to be non-blocking
 					res = hid_set_nonblocking(handle, 1);